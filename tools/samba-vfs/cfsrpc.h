@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,6 +38,12 @@ extern "C" {
 #define CFS_ERR_TIMEOUT         11
 #define CFS_ERR_CONN_REFUSED    12
 #define CFS_ERR_EOF             13
+#define CFS_ERR_NOT_SUPPORTED   14
+#define CFS_ERR_CHECKSUM        15  /* Payload failed CRC32C verification */
+#define CFS_ERR_OFFLINE         16  /* Data is on a cold tier and was not
+                                       recalled (CFS_IO_NORECALL) */
+#define CFS_ERR_BUSY            17  /* An entry is open through some
+                                       gateway (cfs_rpc_remove_tree) */
 
 /* ========================================================================
  * Opaque handle types
@@ -48,10 +55,27 @@ typedef struct cfs_rpc_conn cfs_rpc_conn_t;
 /* Opaque directory handle */
 typedef struct cfs_dir_handle cfs_dir_handle_t;
 
+/* Opaque in-flight asynchronous request */
+typedef struct cfs_rpc_aio cfs_rpc_aio_t;
+
 /* ========================================================================
  * Stat structure (equivalent to struct stat fields used by Samba)
  * ======================================================================== */
 
+/* cfs_stat_t.flags */
+#define CFS_STAT_IMMUTABLE      0x0001u  /* WORM-locked or under legal hold
+                                            (claudefs-meta::worm): neither
+                                            data nor attributes can change */
+#define CFS_STAT_SNAPSHOT       0x0002u  /* Inode is inside a snapshot view;
+                                            fixed for the snapshot's lifetime */
+#define CFS_STAT_WINATTRS       0x0004u  /* dos_attrs and btime_sec are set
+                                            (inode carries Windows attributes) */
+
+/* cfs_stat_t.tier (claudefs-reduce::tier_migration) */
+#define CFS_TIER_HOT            0   /* Data on flash / the capacity tier */
+#define CFS_TIER_COLD           1   /* Data only on a cold tier */
+#define CFS_TIER_RECALLING      2   /* Cold, recall under way */
+
 typedef struct cfs_stat {
     uint64_t inode;
     uint64_t size;
@@ -62,6 +86,14 @@ typedef struct cfs_stat {
     int64_t  atime_sec;
     int64_t  mtime_sec;
     int64_t  ctime_sec;
+    uint32_t flags;     /* CFS_STAT_* */
+    uint64_t change;    /* Change attribute, bumped by every data or
+                           metadata change to the inode */
+    uint32_t dos_attrs; /* FILE_ATTRIBUTE_* */
+    int64_t  btime_sec; /* Creation (birth) time */
+    uint64_t acl_version;   /* Bumped whenever the stored NT security
+                               descriptor changes; 0 = none stored */
+    uint32_t tier;      /* CFS_TIER_* */
 } cfs_stat_t;
 
 /* ========================================================================
@@ -90,6 +122,9 @@ typedef struct cfs_statvfs {
 
 /* ========================================================================
  * Connection management
+ *
+ * A connection may be used from several threads at once; requests issued
+ * concurrently are multiplexed over it.
  * ======================================================================== */
 
 /**
@@ -109,6 +144,199 @@ int cfs_rpc_connect(const char *addr, uint32_t timeout_ms, bool use_mtls,
  */
 void cfs_rpc_disconnect(cfs_rpc_conn_t *conn);
 
+/* ========================================================================
+ * Wire compression (claudefs-transport::compress::Compressor)
+ * ======================================================================== */
+
+#define CFS_COMPRESS_OFF        0
+#define CFS_COMPRESS_LZ4        1
+#define CFS_COMPRESS_ZSTD       2
+#define CFS_COMPRESS_AUTO       3   /* LZ4 for small payloads, zstd for large */
+
+typedef struct cfs_compress_opts {
+    uint32_t algorithm;         /* CFS_COMPRESS_* */
+    uint32_t min_payload_size;  /* Payloads below this are sent uncompressed */
+    bool     passthrough;       /* Ship chunks already compressed by the
+                                   reduce layer as-is instead of inflating
+                                   them server-side and recompressing */
+} cfs_compress_opts_t;
+
+typedef struct cfs_compress_stats {
+    uint64_t bytes_in;          /* Payload bytes before compression */
+    uint64_t bytes_out;         /* Bytes actually put on the wire */
+    uint64_t compressed;        /* Payloads sent compressed */
+    uint64_t skipped;           /* Payloads sent raw (small or incompressible) */
+    uint64_t passthrough;       /* Reduce-layer chunks received without recompression */
+} cfs_compress_stats_t;
+
+/**
+ * Negotiate payload compression for all subsequent I/O on a connection.
+ *
+ * @param conn  Connection handle
+ * @param opts  Requested algorithm and thresholds
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_SUPPORTED if the server does
+ *         not offer the requested algorithm (the connection stays uncompressed)
+ */
+int cfs_rpc_set_compression(cfs_rpc_conn_t *conn, const cfs_compress_opts_t *opts);
+
+int cfs_rpc_compress_stats(cfs_rpc_conn_t *conn, cfs_compress_stats_t *out);
+
+/* ========================================================================
+ * Read source selection (claudefs-transport::cluster_topology)
+ *
+ * Reads that may be served by any replica go to the one with the lowest
+ * measured latency after ranking by proximity to the gateway: same rack,
+ * then same datacenter, then remote sites.  A replica whose replication
+ * lag (claudefs-repl) exceeds max_lag_ms is skipped, and a failed read
+ * moves on to the next candidate without surfacing an error.
+ * ======================================================================== */
+
+typedef struct cfs_locality {
+    char     datacenter[64];    /* TopologyLabel of this gateway; empty ranks */
+    char     rack[64];          /* by measured latency alone */
+    uint32_t max_lag_ms;        /* 0 = only replicas that are fully current */
+    uint32_t remote_penalty_us; /* Added to remote-site latency when ranking */
+} cfs_locality_t;
+
+typedef struct cfs_replica_stats {
+    uint64_t reads_rack;        /* Served from the gateway's rack */
+    uint64_t reads_datacenter;  /* Served elsewhere in its datacenter */
+    uint64_t reads_remote;      /* Served from another site */
+    uint64_t failovers;         /* Reads retried on another replica */
+} cfs_replica_stats_t;
+
+/**
+ * Tell the library where this gateway sits and how stale a replica it may
+ * read from.
+ *
+ * @param conn  Connection handle
+ * @param loc   Topology labels and selection policy
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_SUPPORTED if the cluster has no
+ *         topology information (reads keep going to the primary)
+ */
+int cfs_rpc_set_locality(cfs_rpc_conn_t *conn, const cfs_locality_t *loc);
+
+int cfs_rpc_replica_stats(cfs_rpc_conn_t *conn, cfs_replica_stats_t *out);
+
+/* ========================================================================
+ * Per-request I/O options
+ * ======================================================================== */
+
+#define CFS_IO_NO_COMPRESS      0x0001u   /* Send this payload uncompressed */
+#define CFS_IO_NO_CACHE         0x0002u   /* Don't admit the data into server-side
+                                             caches (one-pass bulk reads) */
+#define CFS_IO_DIRECT_LAYOUT    0x0004u   /* Fetch straight from the EC/replica
+                                             layout on the storage nodes rather
+                                             than through the coordinator */
+#define CFS_IO_FUA              0x0008u   /* Write: commit to the journal before
+                                             replying, as write + fsync would */
+#define CFS_IO_FRAGMENT         0x0010u   /* Read: fetch only the data fragments
+                                             holding the range, straight from
+                                             their storage nodes
+                                             (claudefs-reduce::read_planner);
+                                             fails with CFS_ERR_IO rather than
+                                             reconstructing from parity */
+#define CFS_IO_NORECALL         0x0020u   /* Read: fail with CFS_ERR_OFFLINE
+                                             rather than recall cold data
+                                             before replying */
+
+struct cfs_attrs;
+
+/*
+ * End-to-end integrity: when csum is non-NULL the payload is covered by
+ * CRC32C values (claudefs-reduce::checksum::ChecksumAlgorithm::Crc32c), one
+ * per csum_chunk bytes counted from the start of buf; the last chunk may be
+ * short.  On write the caller fills csum[] and the server verifies before
+ * journaling, failing with CFS_ERR_CHECKSUM.  On read the server fills
+ * csum[] for the bytes returned and the caller verifies in place.
+ */
+typedef struct cfs_io_opts {
+    uint32_t  flags;            /* CFS_IO_* */
+    uint32_t  csum_chunk;       /* Bytes covered by each CRC */
+    uint32_t  csum_count;       /* Entries available in csum[] */
+    uint32_t *csum;             /* Per-chunk CRC32C, or NULL for none */
+    const struct cfs_attrs *attrs;  /* Write: set after the data in the same
+                                       journal entry, or NULL */
+} cfs_io_opts_t;
+
+/* ========================================================================
+ * Data layout
+ * ======================================================================== */
+
+/*
+ * Placement of an open file's data (claudefs-reduce::stripe_coordinator).
+ * For erasure-coded files each stripe holds data_shards * shard_size bytes
+ * of file data; writes covering whole stripes are encoded directly, partial
+ * ones cost a read-modify-write on the storage nodes.  Replicated files
+ * report parity_shards == 0.
+ */
+typedef struct cfs_layout {
+    uint32_t data_shards;
+    uint32_t parity_shards;
+    uint32_t shard_size;        /* Bytes per data shard in a stripe */
+    uint64_t stripe_width;      /* data_shards * shard_size */
+} cfs_layout_t;
+
+/**
+ * Get the data layout of an open file.
+ *
+ * @param conn  Connection handle
+ * @param fh    Open file handle
+ * @param out   Output: layout
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_get_layout(cfs_rpc_conn_t *conn, uint64_t fh, cfs_layout_t *out);
+
+typedef struct cfs_range {
+    uint64_t offset;
+    uint64_t length;
+} cfs_range_t;
+
+/**
+ * Enumerate the allocated (non-hole) ranges of an open file from its block
+ * map (claudefs-reduce::block_map), in ascending order and clipped to
+ * [offset, offset + length).  Adjacent allocated blocks are merged.
+ *
+ * @param conn       Connection handle
+ * @param fh         Open file handle
+ * @param offset     Start of the window
+ * @param length     Length of the window
+ * @param ranges     Output: allocated ranges
+ * @param max        Entries available in ranges
+ * @param count_out  Output: entries filled
+ * @param more_out   Output: true if ranges past the last one returned remain
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_allocated_ranges(cfs_rpc_conn_t *conn, uint64_t fh,
+                              uint64_t offset, uint64_t length,
+                              cfs_range_t *ranges, size_t max,
+                              size_t *count_out, bool *more_out);
+
+/* ========================================================================
+ * Caller identity, for calls the server authorizes itself
+ * ======================================================================== */
+
+/* cfs_caller_t.privileges */
+#define CFS_PRIV_BACKUP         0x0001u /* SeBackupPrivilege: read past ACLs */
+#define CFS_PRIV_RESTORE        0x0002u /* SeRestorePrivilege: write and
+                                           delete past ACLs */
+
+/*
+ * The user a request is made for.  Calls that take one check each inode's
+ * stored NT security descriptor (CFS_ATTR_ACL) against sids, deny ACEs
+ * included, and fall back to POSIX permission checks with uid, gid and
+ * groups on inodes that have none.
+ */
+typedef struct cfs_caller {
+    uint32_t uid;
+    uint32_t gid;
+    const uint32_t *groups;
+    uint32_t ngroups;
+    const char *const *sids;    /* NT token, "S-1-5-21-..." form, user first */
+    uint32_t nsids;
+    uint32_t privileges;        /* CFS_PRIV_* */
+} cfs_caller_t;
+
 /* ========================================================================
  * Metadata operations
  * ======================================================================== */
@@ -117,10 +345,525 @@ int cfs_rpc_stat(cfs_rpc_conn_t *conn, const char *path, cfs_stat_t *out);
 int cfs_rpc_fstat(cfs_rpc_conn_t *conn, uint64_t fh, cfs_stat_t *out);
 int cfs_rpc_mkdir(cfs_rpc_conn_t *conn, const char *path, uint32_t mode);
 int cfs_rpc_rmdir(cfs_rpc_conn_t *conn, const char *path);
+
+/**
+ * Remove everything beneath a directory, leaving the directory itself.
+ * Every entry is checked for caller before anything is removed: DELETE
+ * under its descriptor or FILE_DELETE_CHILD under its parent's, no WORM
+ * lock or legal hold, and no file or directory handle open on it through
+ * any gateway.  If one entry fails, nothing is removed.  The entries are
+ * then detached from the namespace in one transaction and their inodes
+ * reclaimed in the background (claudefs-meta::lazy_delete).
+ *
+ * @param conn         Connection handle
+ * @param path         Directory to empty
+ * @param caller       User the removal is made for
+ * @param entries_out  Output: entries removed (may be NULL)
+ * @param refused      Output: on refusal, the first entry that failed,
+ *                     relative to path (may be NULL)
+ * @param refused_len  Size of refused
+ * @return CFS_ERR_OK on success, CFS_ERR_PERMISSION if an entry may not be
+ *         deleted (ACL or WORM), CFS_ERR_BUSY if one is open,
+ *         CFS_ERR_NOT_DIR if path is not a directory
+ */
+int cfs_rpc_remove_tree(cfs_rpc_conn_t *conn, const char *path,
+                         const cfs_caller_t *caller, uint64_t *entries_out,
+                         char *refused, size_t refused_len);
 int cfs_rpc_unlink(cfs_rpc_conn_t *conn, const char *path);
+
+/**
+ * Remove several entries of one directory in a single RPC.  Entries are
+ * processed independently: one failing does not stop the others.
+ *
+ * @param conn    Connection handle
+ * @param dir     Directory holding the entries
+ * @param names   Entry names within dir
+ * @param count   Entries in names and results
+ * @param results Output: per-entry CFS_ERR_* result
+ * @return CFS_ERR_OK if the batch reached the server (see results), or the
+ *         transport error that applies to every entry
+ */
+int cfs_rpc_unlink_batch(cfs_rpc_conn_t *conn, const char *dir,
+                          const char *const *names, size_t count,
+                          int *results);
 int cfs_rpc_rename(cfs_rpc_conn_t *conn, const char *src, const char *dst);
 int cfs_rpc_statvfs(cfs_rpc_conn_t *conn, const char *path, cfs_statvfs_t *out);
 
+/**
+ * Content epoch of the subtree at path.
+ *
+ * The epoch changes whenever a snapshot is taken of or restored into the
+ * subtree, or anything beneath it is modified, renamed or has its WORM
+ * state changed.  Clients that cache immutable content poll it to decide
+ * when that content must be dropped.
+ *
+ * @param conn      Connection handle
+ * @param path      Absolute path on ClaudeFS (usually the export root)
+ * @param epoch_out Output: opaque epoch, only compared for equality
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_share_epoch(cfs_rpc_conn_t *conn, const char *path,
+                         uint64_t *epoch_out);
+
+/* ========================================================================
+ * Snapshot catalogue (claudefs-reduce::snapshot_catalog)
+ *
+ * Every snapshot is reachable read-only at "/.snapshots/<id>/<path>", where
+ * <path> is the absolute path in the live namespace.  Inode numbers inside
+ * a snapshot view are distinct from the live tree's, and stat results
+ * carry CFS_STAT_SNAPSHOT.
+ * ======================================================================== */
+
+#define CFS_SNAPSHOT_DIR        ".snapshots"
+
+typedef struct cfs_snapshot {
+    uint64_t id;
+    int64_t  created_sec;       /* Creation time, seconds since the epoch (UTC) */
+    char     name[128];
+} cfs_snapshot_t;
+
+/**
+ * List the snapshots that cover a path, newest first.
+ *
+ * @param conn      Connection handle
+ * @param path      Absolute path on ClaudeFS
+ * @param snaps     Output array
+ * @param max       Capacity of snaps
+ * @param count_out Output: number of snapshots available, which may exceed
+ *                  max (only the first max are written)
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_snapshot_list(cfs_rpc_conn_t *conn, const char *path,
+                           cfs_snapshot_t *snaps, size_t max,
+                           size_t *count_out);
+
+/* ========================================================================
+ * Windows attributes (claudefs-meta::xattr, claudefs-meta::acl)
+ *
+ * DOS attributes, birth time and the NT security descriptor are stored on
+ * the inode itself rather than in user xattrs, so they can be set together
+ * with the create that makes the inode.
+ * ======================================================================== */
+
+/* cfs_attrs_t.valid */
+#define CFS_ATTR_DOS            0x0001u  /* dos_attrs */
+#define CFS_ATTR_BTIME          0x0002u  /* btime */
+#define CFS_ATTR_ATIME          0x0004u  /* atime */
+#define CFS_ATTR_MTIME          0x0008u  /* mtime */
+#define CFS_ATTR_ACL            0x0010u  /* acl / acl_len */
+#define CFS_ATTR_INHERIT_ACL    0x0020u  /* Derive the ACL from the parent
+                                            directory's inheritable ACEs;
+                                            ignored with CFS_ATTR_ACL */
+#define CFS_ATTR_UID            0x0040u  /* uid: the POSIX owner, set with the
+                                            descriptor that names it */
+#define CFS_ATTR_GID            0x0080u  /* gid */
+
+/* Largest NT security descriptor the server stores */
+#define CFS_ACL_MAX             65536u
+
+typedef struct cfs_timespec {
+    int64_t  sec;
+    uint32_t nsec;
+} cfs_timespec_t;
+
+typedef struct cfs_attrs {
+    uint32_t valid;             /* CFS_ATTR_* */
+    uint32_t dos_attrs;         /* FILE_ATTRIBUTE_* */
+    cfs_timespec_t btime;
+    cfs_timespec_t atime;
+    cfs_timespec_t mtime;
+    const uint8_t *acl;         /* Self-relative NT security descriptor */
+    size_t acl_len;
+    uint32_t uid;
+    uint32_t gid;
+} cfs_attrs_t;
+
+/**
+ * Set the attributes selected by attrs->valid in one metadata transaction.
+ *
+ * @param conn   Connection handle
+ * @param path   Absolute path on ClaudeFS
+ * @param attrs  Attributes to set
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_setattrs(cfs_rpc_conn_t *conn, const char *path,
+                      const cfs_attrs_t *attrs);
+int cfs_rpc_fsetattrs(cfs_rpc_conn_t *conn, uint64_t fh,
+                       const cfs_attrs_t *attrs);
+
+/**
+ * Get the NT security descriptor stored on an inode.
+ *
+ * @param conn     Connection handle
+ * @param path     Absolute path on ClaudeFS
+ * @param buf      Output buffer; CFS_ACL_MAX bytes always suffice
+ * @param buflen   Size of buf
+ * @param len_out  Output: descriptor length
+ * @param version_out Output: the descriptor's acl_version
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_FOUND when the inode has no
+ *         stored descriptor (only POSIX mode bits)
+ */
+int cfs_rpc_get_acl(cfs_rpc_conn_t *conn, const char *path,
+                     uint8_t *buf, size_t buflen, size_t *len_out,
+                     uint64_t *version_out);
+int cfs_rpc_fget_acl(cfs_rpc_conn_t *conn, uint64_t fh,
+                      uint8_t *buf, size_t buflen, size_t *len_out,
+                      uint64_t *version_out);
+
+/**
+ * Ask to be told about descriptor changes under path: the server pushes a
+ * notice whenever a stored descriptor is set, replaced or removed, and
+ * each notice bumps the connection's ACL epoch.
+ *
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_SUPPORTED on older servers
+ */
+int cfs_rpc_acl_subscribe(cfs_rpc_conn_t *conn, const char *path);
+
+/**
+ * Current ACL epoch of a connection.  Local: no round trip, safe to call
+ * from any thread.
+ */
+uint64_t cfs_rpc_acl_epoch(cfs_rpc_conn_t *conn);
+
+/* ========================================================================
+ * Extended attributes (claudefs-meta::xattr)
+ *
+ * Every call moves any number of one inode's attributes in one round trip.
+ * ======================================================================== */
+
+/* cfs_xattr_t.flags */
+#define CFS_XATTR_CREATE        0x0001u  /* Set: fail with CFS_ERR_EXISTS if
+                                            the attribute exists */
+#define CFS_XATTR_REPLACE       0x0002u  /* Set: fail with CFS_ERR_NOT_FOUND
+                                            if it does not */
+
+typedef struct cfs_xattr {
+    const char *name;
+    const uint8_t *value;       /* Get: points into the caller's buffer;
+                                   set: NULL removes the attribute */
+    size_t len;
+    uint32_t flags;             /* CFS_XATTR_* */
+    int err;                    /* Output: CFS_ERR_* for this entry */
+} cfs_xattr_t;
+
+/**
+ * Get several attributes by name.  Values are packed into buf and each
+ * entry's value / len set; absent attributes get err CFS_ERR_NOT_FOUND.
+ *
+ * @param conn    Connection handle
+ * @param path    Absolute path on ClaudeFS
+ * @param xa      Entries, name filled in by the caller
+ * @param count   Number of entries
+ * @param buf     Output buffer for the values
+ * @param buflen  Size of buf
+ * @return CFS_ERR_OK when every entry was answered (see err),
+ *         CFS_ERR_NO_SPACE when the values do not fit in buf
+ */
+int cfs_rpc_getxattrs(cfs_rpc_conn_t *conn, const char *path,
+                       cfs_xattr_t *xa, size_t count,
+                       uint8_t *buf, size_t buflen);
+int cfs_rpc_fgetxattrs(cfs_rpc_conn_t *conn, uint64_t fh,
+                        cfs_xattr_t *xa, size_t count,
+                        uint8_t *buf, size_t buflen);
+
+/**
+ * List all attributes of an inode together with their values.  Names and
+ * values are packed into buf and the first *count_out entries of xa point
+ * into it.
+ *
+ * @return CFS_ERR_OK on success, CFS_ERR_NO_SPACE when there are more than
+ *         max attributes or they do not fit in buf
+ */
+int cfs_rpc_listxattrs(cfs_rpc_conn_t *conn, const char *path,
+                        cfs_xattr_t *xa, size_t max, size_t *count_out,
+                        uint8_t *buf, size_t buflen);
+int cfs_rpc_flistxattrs(cfs_rpc_conn_t *conn, uint64_t fh,
+                         cfs_xattr_t *xa, size_t max, size_t *count_out,
+                         uint8_t *buf, size_t buflen);
+
+/**
+ * List only the names of an inode's attributes, each NUL-terminated and
+ * packed one after another as listxattr(2) returns them.  Any number of
+ * attributes: the names are streamed into buf without a per-call limit.
+ *
+ * @param conn     Connection handle
+ * @param path     Absolute path on ClaudeFS
+ * @param buf      Output buffer for the names; may be NULL when buflen is 0
+ * @param buflen   Size of buf
+ * @param len_out  Output: total length of the names, set on success and
+ *                 on CFS_ERR_NO_SPACE
+ * @return CFS_ERR_OK on success, CFS_ERR_NO_SPACE when they do not fit in
+ *         buf (buflen 0 just asks for the size)
+ */
+int cfs_rpc_listxattr_names(cfs_rpc_conn_t *conn, const char *path,
+                             char *buf, size_t buflen, size_t *len_out);
+int cfs_rpc_flistxattr_names(cfs_rpc_conn_t *conn, uint64_t fh,
+                              char *buf, size_t buflen, size_t *len_out);
+
+/**
+ * Set or remove several attributes in one metadata transaction: when any
+ * entry fails (see its err) none is applied.
+ *
+ * @return CFS_ERR_OK when all entries were applied, else the first
+ *         failing entry's error
+ */
+int cfs_rpc_setxattrs(cfs_rpc_conn_t *conn, const char *path,
+                       cfs_xattr_t *xa, size_t count);
+int cfs_rpc_fsetxattrs(cfs_rpc_conn_t *conn, uint64_t fh,
+                        cfs_xattr_t *xa, size_t count);
+
+/* cfs_dirent_meta_t.xattr_count when the entry's xattrs were left out */
+#define CFS_XATTRS_OMITTED      SIZE_MAX
+
+typedef struct cfs_dirent_meta {
+    cfs_dirent_t de;
+    cfs_stat_t st;
+    size_t xattr_first;         /* Index of its first xattr in xa[] */
+    size_t xattr_count;         /* CFS_XATTRS_OMITTED when a value exceeded
+                                   max_value or did not fit */
+} cfs_dirent_meta_t;
+
+/**
+ * List a directory together with every entry's attributes and complete
+ * xattr set, so a client showing a folder's metadata needs one round trip.
+ *
+ * @param conn       Connection handle
+ * @param path       Absolute path of the directory
+ * @param max_value  Largest xattr value returned
+ * @param ents       Output: entries
+ * @param max_ents   Size of ents
+ * @param count_out  Output: entries returned
+ * @param xa         Output: xattrs, names and values pointing into buf
+ * @param max_xa     Size of xa
+ * @param buf        Output buffer for names and values
+ * @param buflen     Size of buf
+ * @param more_out   Output: the directory has entries beyond those returned
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_readdir_meta(cfs_rpc_conn_t *conn, const char *path,
+                          size_t max_value, cfs_dirent_meta_t *ents,
+                          size_t max_ents, size_t *count_out,
+                          cfs_xattr_t *xa, size_t max_xa,
+                          uint8_t *buf, size_t buflen, bool *more_out);
+
+/* ========================================================================
+ * Tier recall (claudefs-reduce::tier_migration)
+ *
+ * Recalls run in the background on the storage nodes and bring a file
+ * back front to back; one recall serves every reader of the file.
+ * ======================================================================== */
+
+#define CFS_RECALL_SIBLINGS     0x0001u /* Also queue the other cold files of
+                                           the same directory, as one batch
+                                           (recall-ahead) */
+
+typedef struct cfs_recall_status {
+    uint32_t tier;              /* CFS_TIER_* */
+    uint64_t resident;          /* Bytes from offset 0 back on a hot tier */
+    uint64_t size;
+} cfs_recall_status_t;
+
+/**
+ * Start recalling an open file unless already under way (flags apply only
+ * then), and wait until its first upto bytes are resident or timeout_ms
+ * has passed, whichever comes first.
+ *
+ * @param conn        Connection handle
+ * @param fh          File handle
+ * @param upto        Bytes needed from offset 0 (UINT64_MAX: all)
+ * @param flags       CFS_RECALL_*
+ * @param timeout_ms  Longest wait
+ * @param st          Output: progress when the call returned
+ * @return CFS_ERR_OK on success, including on timeout (see st)
+ */
+int cfs_rpc_frecall_wait(cfs_rpc_conn_t *conn, uint64_t fh, uint64_t upto,
+                          uint32_t flags, uint32_t timeout_ms,
+                          cfs_recall_status_t *st);
+
+/* ========================================================================
+ * Access heat (claudefs-reduce::tiering_advisor)
+ * ======================================================================== */
+
+typedef struct cfs_heat_ent {
+    uint64_t inode;
+    uint64_t hits;              /* Sampled accesses; over by at most error */
+    uint64_t error;
+    uint64_t read_bytes;        /* Bytes of the sampled reads */
+    uint64_t write_bytes;       /* Bytes of the sampled writes */
+} cfs_heat_ent_t;
+
+/**
+ * Report the inodes a client accessed most over an interval, so the
+ * tiering advisor can keep them on (or bring them back to) flash.  The
+ * report is queued and sent without waiting for a reply.
+ *
+ * @param conn        Connection handle
+ * @param ents        Most accessed inodes, any order
+ * @param count       Entries in ents
+ * @param sample      One access in sample was counted
+ * @param interval_s  Seconds the report covers
+ * @return CFS_ERR_OK once queued
+ */
+int cfs_rpc_heat_report(cfs_rpc_conn_t *conn, const cfs_heat_ent_t *ents,
+                         size_t count, uint32_t sample, uint32_t interval_s);
+
+/* ========================================================================
+ * Space accounting (claudefs-meta::space_accounting)
+ * ======================================================================== */
+
+typedef struct cfs_dir_usage {
+    uint64_t bytes;             /* Logical size of every file below */
+    uint64_t alloc_bytes;       /* Space those files occupy */
+    uint64_t files;
+    uint64_t dirs;              /* Not counting the directory itself */
+    uint64_t as_of_sec;         /* Totals include all changes up to here */
+} cfs_dir_usage_t;
+
+/**
+ * Recursive usage of a directory tree, from the totals the metadata
+ * service keeps per directory: one RPC however large the tree.
+ *
+ * @param conn  Connection handle
+ * @param path  Absolute path of a directory
+ * @param out   Output: usage
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_DIR if path is not a directory
+ */
+int cfs_rpc_dir_usage(cfs_rpc_conn_t *conn, const char *path,
+                       cfs_dir_usage_t *out);
+
+/* ========================================================================
+ * Subtree search (claudefs-mgmt::indexer, claudefs-mgmt::query_gateway)
+ * ======================================================================== */
+
+/* cfs_search_query_t.flags */
+#define CFS_SEARCH_FILES        0x0001u /* Return regular files */
+#define CFS_SEARCH_DIRS         0x0002u /* Return directories */
+#define CFS_SEARCH_NOCASE       0x0004u /* Match pattern case-insensitively */
+
+typedef struct cfs_search_query {
+    const char *pattern;        /* Wildcard (* ?) on the entry name, NULL = any */
+    uint32_t flags;             /* CFS_SEARCH_* */
+    uint64_t min_size;
+    uint64_t max_size;          /* 0 = no limit */
+    int64_t mtime_after;        /* Unix seconds, 0 = no bound */
+    int64_t mtime_before;       /* Unix seconds, 0 = no bound */
+    /*
+     * Searcher: a hit is returned only when the caller could have walked
+     * to it, i.e. the stored descriptors (mode bits where there are none)
+     * of every directory from root down grant them traverse and of its
+     * parent list, as for an SMB directory walk
+     */
+    const cfs_caller_t *caller;
+} cfs_search_query_t;
+
+typedef struct cfs_search_hit {
+    const char *path;           /* Relative to the search root, in buf */
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mode;
+} cfs_search_hit_t;
+
+/**
+ * Find the entries below root matching a query, evaluated by the metadata
+ * indexer instead of a tree walk.  The index trails the namespace by the
+ * indexer's lag (seconds), so very recent changes may be missing.
+ *
+ * @param conn       Connection handle
+ * @param root       Absolute path of the directory to search under
+ * @param q          Query
+ * @param cookie     In: 0 to start, else the value a previous call returned;
+ *                   out: where to resume, 0 once every hit has been returned; a call
+ *                   returns no hits without finishing only when the next
+ *                   path does not fit in buf
+ * @param hits       Output: hits, paths pointing into buf
+ * @param max_hits   Size of hits
+ * @param count_out  Output: hits returned
+ * @param buf        Output buffer for paths
+ * @param buflen     Size of buf
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_SUPPORTED without an indexer
+ */
+int cfs_rpc_search(cfs_rpc_conn_t *conn, const char *root,
+                    const cfs_search_query_t *q, uint64_t *cookie,
+                    cfs_search_hit_t *hits, size_t max_hits, size_t *count_out,
+                    char *buf, size_t buflen);
+
+/* ========================================================================
+ * Quotas (claudefs-meta::quota)
+ * ======================================================================== */
+
+/* cfs_quota_t.kind */
+#define CFS_QUOTA_USER          0
+#define CFS_QUOTA_GROUP         1
+#define CFS_QUOTA_DIR           2   /* Nearest directory quota above path */
+
+typedef struct cfs_quota {
+    uint32_t kind;              /* CFS_QUOTA_* */
+    uint32_t id;                /* uid or gid; ignored for CFS_QUOTA_DIR */
+    uint64_t bytes_used;
+    uint64_t bytes_soft;        /* Limits: 0 = none */
+    uint64_t bytes_hard;
+    uint64_t files_used;
+    uint64_t files_soft;
+    uint64_t files_hard;
+} cfs_quota_t;
+
+/**
+ * Get a quota.  Limits and usage are those of the quota domain containing
+ * path (for CFS_QUOTA_DIR, of the nearest directory quota above it).
+ *
+ * @param conn  Connection handle
+ * @param path  Absolute path on ClaudeFS
+ * @param q     In: kind and id; out: limits and usage
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_FOUND when no quota applies
+ */
+int cfs_rpc_quota_get(cfs_rpc_conn_t *conn, const char *path, cfs_quota_t *q);
+
+/**
+ * Set the limits of a user or group quota (usage fields are ignored).
+ */
+int cfs_rpc_quota_set(cfs_rpc_conn_t *conn, const char *path,
+                       const cfs_quota_t *q);
+
+/**
+ * Ask to be told about quota changes under path: the server pushes a
+ * notice whenever a limit changes or usage moves by more than 1% of a
+ * limit, and each notice bumps the connection's quota epoch.
+ *
+ * @return CFS_ERR_OK on success, CFS_ERR_NOT_SUPPORTED without quotas
+ */
+int cfs_rpc_quota_subscribe(cfs_rpc_conn_t *conn, const char *path);
+
+/**
+ * Current quota epoch of a connection.  Local: no round trip, safe to
+ * call from any thread.
+ */
+uint64_t cfs_rpc_quota_epoch(cfs_rpc_conn_t *conn);
+
+/* ========================================================================
+ * Identity mapping (claudefs-meta::uidmap)
+ *
+ * The cluster's authoritative uid/gid <-> Windows SID mapping, the same one
+ * the FUSE client applies (claudefs-fuse::idmap).
+ * ======================================================================== */
+
+typedef struct cfs_idmap_ent {
+    uint32_t id;                /* uid, or gid with is_group */
+    bool     is_group;
+    char     sid[72];           /* Output: "S-1-5-21-...", or "" when the
+                                   cluster has no mapping for the id */
+} cfs_idmap_ent_t;
+
+/**
+ * Resolve several uids / gids to SIDs in one call.
+ *
+ * @param conn   Connection handle
+ * @param ents   Entries, id and is_group filled in by the caller
+ * @param count  Number of entries
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_idmap_resolve(cfs_rpc_conn_t *conn, cfs_idmap_ent_t *ents,
+                           size_t count);
+
 /* ========================================================================
  * File I/O operations
  * ======================================================================== */
@@ -138,6 +881,37 @@ int cfs_rpc_statvfs(cfs_rpc_conn_t *conn, const char *path, cfs_statvfs_t *out);
 int cfs_rpc_open(cfs_rpc_conn_t *conn, const char *path, int flags,
                   uint32_t mode, uint64_t *fh_out);
 
+/**
+ * Open a file, creating it with an initial attribute bundle.
+ *
+ * Behaves like cfs_rpc_open with O_CREAT in flags.  When the call creates
+ * the file, attrs is applied in the same metadata transaction, so no client
+ * ever sees the new inode without them; an existing file is opened unchanged.
+ * A descriptor without an owner or group gets the creator's; with
+ * CFS_ATTR_INHERIT_ACL and no inheritable ACEs on the parent, no descriptor
+ * is stored.  The descriptor derived for CFS_ATTR_INHERIT_ACL is returned
+ * in acl_out, so the caller can tell whether it is the one it would have
+ * stored itself.
+ *
+ * @param conn        Connection handle
+ * @param path        Absolute path on ClaudeFS
+ * @param flags       Open flags; O_CREAT is implied
+ * @param mode        Creation mode
+ * @param attrs       Attributes for a newly created file, or NULL
+ * @param acl_out     Output: the inherited descriptor stored, self-relative
+ *                    (may be NULL)
+ * @param acl_buflen  Size of acl_out
+ * @param acl_len_out Output: its length; 0 if none was derived or it did not
+ *                    fit in acl_out (may be NULL)
+ * @param fh_out      Output: file handle
+ * @param created_out Output: whether this call created the file
+ * @return CFS_ERR_OK on success
+ */
+int cfs_rpc_create(cfs_rpc_conn_t *conn, const char *path, int flags,
+                    uint32_t mode, const cfs_attrs_t *attrs,
+                    uint8_t *acl_out, size_t acl_buflen, size_t *acl_len_out,
+                    uint64_t *fh_out, bool *created_out);
+
 int cfs_rpc_close(cfs_rpc_conn_t *conn, uint64_t fh);
 
 /**
@@ -168,9 +942,59 @@ int cfs_rpc_read(cfs_rpc_conn_t *conn, uint64_t fh, int64_t offset,
 int cfs_rpc_write(cfs_rpc_conn_t *conn, uint64_t fh, int64_t offset,
                    const void *buf, size_t len, ssize_t *bytes_written);
 
+/**
+ * Read / write with per-request options. A NULL opts behaves exactly like
+ * cfs_rpc_read / cfs_rpc_write.
+ */
+int cfs_rpc_read_ex(cfs_rpc_conn_t *conn, uint64_t fh, int64_t offset,
+                     void *buf, size_t len, const cfs_io_opts_t *opts,
+                     ssize_t *bytes_read);
+int cfs_rpc_write_ex(cfs_rpc_conn_t *conn, uint64_t fh, int64_t offset,
+                      const void *buf, size_t len, const cfs_io_opts_t *opts,
+                      ssize_t *bytes_written);
+
+/**
+ * Submit a read without waiting for it.  buf and opts (including its csum
+ * array) must stay valid until the request is waited on or cancelled.
+ *
+ * @param aio_out Output: request handle for cfs_rpc_aio_wait / _cancel
+ * @return CFS_ERR_OK if the request was queued
+ */
+int cfs_rpc_read_submit(cfs_rpc_conn_t *conn, uint64_t fh, int64_t offset,
+                         void *buf, size_t len, const cfs_io_opts_t *opts,
+                         cfs_rpc_aio_t **aio_out);
+
+/**
+ * Wait for a submitted request and release it.
+ *
+ * @param bytes_out Output: bytes transferred
+ * @return the request's result, as the synchronous call would return it
+ */
+int cfs_rpc_aio_wait(cfs_rpc_aio_t *aio, ssize_t *bytes_out);
+
+/**
+ * Abandon a submitted request and release it.  On return the library no
+ * longer touches the request's buffers.
+ */
+void cfs_rpc_aio_cancel(cfs_rpc_aio_t *aio);
+
 int cfs_rpc_ftruncate(cfs_rpc_conn_t *conn, uint64_t fh, int64_t len);
 int cfs_rpc_fsync(cfs_rpc_conn_t *conn, uint64_t fh);
 
+/**
+ * Make the written data of several handles durable with a single journal
+ * commit on the server (claudefs-reduce::write_journal group commit).
+ *
+ * @param conn    Connection handle
+ * @param fhs     Handles to commit
+ * @param count   Entries in fhs and results
+ * @param results Output: per-handle CFS_ERR_* result
+ * @return CFS_ERR_OK if the batch reached the server (see results), or the
+ *         transport error that applies to every handle
+ */
+int cfs_rpc_fsync_batch(cfs_rpc_conn_t *conn, const uint64_t *fhs,
+                         size_t count, int *results);
+
 /* ========================================================================
  * Directory operations
  * ======================================================================== */